@@ -10,6 +10,94 @@
 #include <linux/interrupt.h>
 #include <linux/poll.h>
 #include <linux/timer.h>
+#include <linux/gpio_keys.h>
+#include <linux/input.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+
+#include "../led/rk_led.h"
+
+/*
+ * Optional input-subsystem bridge: all buttons report on one shared
+ * input_dev, and edges whose debounce completes in the same timer softirq
+ * are grouped into a single SYN_REPORT frame by button_sync_tasklet.
+ * Its keybits come from keymap and the DT linux,code values at init; a
+ * button probing with any other code makes the device be registered again.
+ */
+static bool input_bridge;
+module_param(input_bridge, bool, 0444);
+MODULE_PARM_DESC(input_bridge, "Also report buttons through an input device");
+
+#define BUTTON_MAX_KEYS (8)
+static unsigned int keymap[BUTTON_MAX_KEYS] = {
+    KEY_PROG1, KEY_PROG2, KEY_PROG3, KEY_PROG4,
+};
+static int nr_keymap = 4;
+module_param_array(keymap, uint, &nr_keymap, 0444);
+MODULE_PARM_DESC(keymap, "Key codes handed to buttons without linux,code");
+
+/*
+ * Interrupt-storm protection: more than storm_threshold edges inside one
+ * STORM_WINDOW masks the line's IRQ and samples it every storm_poll_ms
+ * instead, until it has read the same value storm_stable_polls times.
+ */
+#define STORM_WINDOW    (HZ / 10)
+
+static unsigned int storm_threshold = 200;
+module_param(storm_threshold, uint, 0644);
+MODULE_PARM_DESC(storm_threshold, "Edges per 100ms that mask the button IRQ");
+
+static unsigned int storm_poll_ms = 20;
+module_param(storm_poll_ms, uint, 0644);
+MODULE_PARM_DESC(storm_poll_ms, "Sampling period while the IRQ is masked (ms)");
+
+static unsigned int storm_stable_polls = 10;
+module_param(storm_stable_polls, uint, 0644);
+MODULE_PARM_DESC(storm_stable_polls, "Equal samples before the IRQ is unmasked");
+
+/*
+ * Reflex bindings: LED actions run straight from the debounce timer,
+ * before userspace is woken. Set through the "reflex" sysfs attribute.
+ */
+#define BUTTON_MAX_REFLEX   (8)
+
+#define REFLEX_PRESS        (0)
+#define REFLEX_RELEASE      (1)     /* release before long_press_ms */
+#define REFLEX_LONG         (2)     /* release after long_press_ms */
+
+/* rk_led_reflex() is resolved with symbol_get() once a binding exists */
+
+static const char * const reflex_events[] = { "press", "release", "long" };
+static const char * const reflex_actions[] = { "set", "clear", "toggle", "blink" };
+
+static unsigned int long_press_ms = 800;
+module_param(long_press_ms, uint, 0644);
+MODULE_PARM_DESC(long_press_ms, "Hold time that turns a release into a long press (ms)");
+
+struct button_reflex {
+    unsigned int event;
+    unsigned int action;
+    unsigned int count;         /* blinks */
+    char led[32];
+};
+
+static struct input_dev *button_input;
+static DEFINE_SPINLOCK(button_input_lock);      /* button_input vs. reports */
+static DEFINE_MUTEX(button_input_mutex);        /* button_keybit, re-registration */
+static unsigned long button_keybit[BITS_TO_LONGS(KEY_CNT)];
+static unsigned int button_input_index;         /* next keymap entry */
+
+static void button_input_sync(unsigned long data)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&button_input_lock, flags);
+    if (button_input)
+        input_sync(button_input);
+    spin_unlock_irqrestore(&button_input_lock, flags);
+}
+
+static DECLARE_TASKLET(button_sync_tasklet, button_input_sync, 0);
 
 struct button_data {
     unsigned int gpio;
@@ -20,23 +108,130 @@ struct button_data {
     int ev_press;               /* wait's condition */
     wait_queue_head_t waitq;    /* wait queue head */
     int value;                  /* button value, to user */
+    bool active_low;
+    unsigned int code;          /* input bridge key code, 0 when disabled */
+    ktime_t edge_time;          /* last edge, taken in hard irq */
+    /* interrupt-storm protection */
+    unsigned long window_start; /* jiffies */
+    unsigned int window_edges;
+    bool storm;                 /* irq masked, line polled by poll_timer */
+    struct timer_list poll_timer;
+    int poll_value;
+    unsigned int poll_stable;
+    unsigned long irq_count;
+    unsigned long storm_count;
+    /* reflex bindings */
+    spinlock_t reflex_lock;     /* reflex, nr_reflex, led_reflex */
+    struct button_reflex reflex[BUTTON_MAX_REFLEX];
+    unsigned int nr_reflex;
+    int (*led_reflex)(const char *name, unsigned int action, unsigned int count);
+    unsigned long press_time;   /* jiffies */
 };
 
 //static DECLARE_WAIT_QUEUE_HEAD(button_waitq);
 
+static void button_reflex_run(struct button_data *button_data, unsigned int event)
+{
+    struct button_reflex *reflex;
+    unsigned long flags;
+    int i;
+
+    spin_lock_irqsave(&button_data->reflex_lock, flags);
+    for (i = 0; i < button_data->nr_reflex; i++) {
+        reflex = &button_data->reflex[i];
+        if (reflex->event == event)
+            button_data->led_reflex(reflex->led, reflex->action, reflex->count);
+    }
+    spin_unlock_irqrestore(&button_data->reflex_lock, flags);
+}
+
 static void button_timeout_fun(unsigned long data)
 {
     struct button_data *button_data = (struct button_data *)data;
+    int old = button_data->value;
+    unsigned long flags;
 
     button_data->value = gpio_get_value(button_data->gpio); /* read key value */
+
+    /* LED feedback first, it must not wait for userspace */
+    if (button_data->nr_reflex && button_data->value != old) {
+        if (!!button_data->value ^ button_data->active_low) {
+            button_data->press_time = jiffies;
+            button_reflex_run(button_data, REFLEX_PRESS);
+        } else {
+            /* a release is either short or long, never both */
+            if (time_after_eq(jiffies, button_data->press_time +
+                                       msecs_to_jiffies(long_press_ms)))
+                button_reflex_run(button_data, REFLEX_LONG);
+            else
+                button_reflex_run(button_data, REFLEX_RELEASE);
+        }
+    }
+
     button_data->ev_press = 1;                              /* set wait's condition */
     wake_up_interruptible(&button_data->waitq);             /* wake up */
+
+    if (!button_data->code)
+        return;
+
+    spin_lock_irqsave(&button_input_lock, flags);
+    if (button_input) {
+        /* timestamp of the edge itself, not of the debounced report */
+        input_event(button_input, EV_MSC, MSC_TIMESTAMP,
+                    (u32)ktime_to_us(button_data->edge_time));
+        input_report_key(button_input, button_data->code,
+                         !!button_data->value ^ button_data->active_low);
+        tasklet_schedule(&button_sync_tasklet);
+    }
+    spin_unlock_irqrestore(&button_input_lock, flags);
+}
+
+static void button_poll_fun(unsigned long data)
+{
+    struct button_data *button_data = (struct button_data *)data;
+    int val = gpio_get_value(button_data->gpio);
+
+    if (val != button_data->poll_value) {
+        button_data->poll_value = val;
+        button_data->poll_stable = 0;
+    } else if (++button_data->poll_stable >= storm_stable_polls) {
+        /* line settled: report its state if it changed, back to irq mode */
+        if (val != button_data->value) {
+            button_data->edge_time = ktime_get();
+            button_timeout_fun(data);
+        }
+        button_data->window_start = jiffies;
+        button_data->window_edges = 0;
+        button_data->storm = false;
+        enable_irq(button_data->irq);
+        return;
+    }
+    mod_timer(&button_data->poll_timer, jiffies + msecs_to_jiffies(storm_poll_ms));
 }
 
 static irqreturn_t button_interrupt(int irq, void *arg)
 {
     struct button_data *button_data = arg;
 
+    button_data->irq_count++;
+    if (time_after(jiffies, button_data->window_start + STORM_WINDOW)) {
+        button_data->window_start = jiffies;
+        button_data->window_edges = 0;
+    }
+    if (++button_data->window_edges > storm_threshold) {
+        disable_irq_nosync(irq);
+        /* drop the debounce armed by earlier edges: no mid-storm reports */
+        del_timer(&button_data->timer);
+        button_data->storm = true;
+        button_data->storm_count++;
+        button_data->poll_value = gpio_get_value(button_data->gpio);
+        button_data->poll_stable = 0;
+        mod_timer(&button_data->poll_timer,
+                  jiffies + msecs_to_jiffies(storm_poll_ms));
+        return IRQ_HANDLED;
+    }
+
+    button_data->edge_time = ktime_get();
     /* set time and active timer */
     mod_timer(&button_data->timer, jiffies + HZ / 100);
     return IRQ_HANDLED;
@@ -102,6 +297,197 @@ static const struct file_operations button_misc_fops = {
     .poll    =   button_poll,
 };
 
+static ssize_t irq_count_show(struct device *dev,
+        struct device_attribute *attr, char *buf)
+{
+    struct button_data *button_data = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%lu\n", button_data->irq_count);
+}
+static DEVICE_ATTR_RO(irq_count);
+
+static ssize_t storm_count_show(struct device *dev,
+        struct device_attribute *attr, char *buf)
+{
+    struct button_data *button_data = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%lu\n", button_data->storm_count);
+}
+static DEVICE_ATTR_RO(storm_count);
+
+static ssize_t storm_show(struct device *dev,
+        struct device_attribute *attr, char *buf)
+{
+    struct button_data *button_data = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%d\n", button_data->storm);
+}
+static DEVICE_ATTR_RO(storm);
+
+/* one binding per line: "<press|release|long> <led name> <action> [count]" */
+static ssize_t reflex_show(struct device *dev,
+        struct device_attribute *attr, char *buf)
+{
+    struct button_data *button_data = dev_get_drvdata(dev);
+    struct button_reflex *reflex;
+    unsigned long flags;
+    ssize_t len = 0;
+    int i;
+
+    spin_lock_irqsave(&button_data->reflex_lock, flags);
+    for (i = 0; i < button_data->nr_reflex; i++) {
+        reflex = &button_data->reflex[i];
+        len += scnprintf(buf + len, PAGE_SIZE - len, "%s %s %s",
+                         reflex_events[reflex->event], reflex->led,
+                         reflex_actions[reflex->action]);
+        if (reflex->action == RK_LED_REFLEX_BLINK)
+            len += scnprintf(buf + len, PAGE_SIZE - len, " %u", reflex->count);
+        len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+    }
+    spin_unlock_irqrestore(&button_data->reflex_lock, flags);
+
+    return len;
+}
+
+/* "clear" drops every binding, anything else adds one */
+static ssize_t reflex_store(struct device *dev,
+        struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct button_data *button_data = dev_get_drvdata(dev);
+    struct button_reflex reflex = { .count = 1 };
+    int (*led_reflex)(const char *, unsigned int, unsigned int) = NULL;
+    char event[8], action[8];
+    unsigned long flags;
+    int i, ret = count;
+
+    if (sysfs_streq(buf, "clear")) {
+        spin_lock_irqsave(&button_data->reflex_lock, flags);
+        button_data->nr_reflex = 0;
+        led_reflex = button_data->led_reflex;
+        button_data->led_reflex = NULL;
+        spin_unlock_irqrestore(&button_data->reflex_lock, flags);
+        if (led_reflex)
+            symbol_put(rk_led_reflex);
+        return count;
+    }
+
+    if (sscanf(buf, "%7s %31s %7s %u", event, reflex.led, action, &reflex.count) < 3)
+        return -EINVAL;
+
+    for (i = 0; i < ARRAY_SIZE(reflex_events); i++)
+        if (!strcmp(event, reflex_events[i]))
+            break;
+    if (i == ARRAY_SIZE(reflex_events))
+        return -EINVAL;
+    reflex.event = i;
+
+    for (i = 0; i < ARRAY_SIZE(reflex_actions); i++)
+        if (!strcmp(action, reflex_actions[i]))
+            break;
+    if (i == ARRAY_SIZE(reflex_actions))
+        return -EINVAL;
+    reflex.action = i;
+
+    /* hold rk_led while this button has bindings */
+    if (!button_data->led_reflex) {
+        led_reflex = symbol_get(rk_led_reflex);
+        if (!led_reflex)
+            return -ENODEV;
+    }
+
+    spin_lock_irqsave(&button_data->reflex_lock, flags);
+    if (button_data->nr_reflex == BUTTON_MAX_REFLEX) {
+        ret = -ENOSPC;
+    } else {
+        button_data->reflex[button_data->nr_reflex++] = reflex;
+        if (!button_data->led_reflex) {
+            button_data->led_reflex = led_reflex;
+            led_reflex = NULL;
+        }
+    }
+    spin_unlock_irqrestore(&button_data->reflex_lock, flags);
+
+    /* table full, or raced with another writer for the reference */
+    if (led_reflex)
+        symbol_put(rk_led_reflex);
+    return ret;
+}
+static DEVICE_ATTR_RW(reflex);
+
+static struct attribute *button_attrs[] = {
+    &dev_attr_irq_count.attr,
+    &dev_attr_storm_count.attr,
+    &dev_attr_storm.attr,
+    &dev_attr_reflex.attr,
+    NULL,
+};
+
+static const struct attribute_group button_attr_group = {
+    .attrs = button_attrs,
+};
+
+static struct input_dev *button_input_create(void)
+{
+    struct input_dev *input;
+    int err;
+
+    input = input_allocate_device();
+    if (!input)
+        return ERR_PTR(-ENOMEM);
+
+    input->name = "rk_button";
+    input->phys = "rk_button/input0";
+    input->id.bustype = BUS_HOST;
+    __set_bit(EV_KEY, input->evbit);
+    __set_bit(EV_MSC, input->evbit);
+    __set_bit(MSC_TIMESTAMP, input->mscbit);
+    bitmap_copy(input->keybit, button_keybit, KEY_CNT);
+
+    err = input_register_device(input);
+    if (err) {
+        input_free_device(input);
+        return ERR_PTR(err);
+    }
+    return input;
+}
+
+static int button_input_add(struct button_data *button_data, unsigned int code)
+{
+    struct input_dev *input, *old;
+    unsigned long flags;
+    int err = 0;
+
+    mutex_lock(&button_input_mutex);
+    /* linux,code / pdata->code first, then the keymap parameter in probe order */
+    if (!code && button_input_index < nr_keymap)
+        code = keymap[button_input_index++];
+    if (!code || code > KEY_MAX) {
+        pr_err("%s: no valid key code for the input bridge\n", button_data->name);
+        err = -EINVAL;
+        goto out;
+    }
+    if (!test_bit(code, button_keybit)) {
+        /* keybits are fixed once registered: swap in a device that has it */
+        __set_bit(code, button_keybit);
+        input = button_input_create();
+        if (IS_ERR(input)) {
+            __clear_bit(code, button_keybit);
+            pr_err("%s: input_register_device error!\n", button_data->name);
+            err = PTR_ERR(input);
+            goto out;
+        }
+        spin_lock_irqsave(&button_input_lock, flags);
+        old = button_input;
+        button_input = input;
+        spin_unlock_irqrestore(&button_input_lock, flags);
+        input_unregister_device(old);
+    }
+    button_data->code = code;
+out:
+    mutex_unlock(&button_input_mutex);
+    return err;
+}
+
 static int button_probe(struct platform_device *pdev)
 {
     struct device_node *np = pdev->dev.of_node;
@@ -110,10 +496,28 @@ static int button_probe(struct platform_device *pdev)
     unsigned int button_irq;
     enum of_gpio_flags flag;
     const char *button_name;
-
-    of_property_read_string(np, "button_name", &button_name);
-
-    button_gpio = of_get_named_gpio_flags(np, "button_gpio", 0, &flag);
+    unsigned int code = 0;
+    bool active_low = false;
+
+    if (np) {
+        of_property_read_string(np, "button_name", &button_name);
+        button_gpio = of_get_named_gpio_flags(np, "button_gpio", 0, &flag);
+        of_property_read_u32(np, "linux,code", &code);
+        active_low = of_property_read_bool(np, "active-low");
+    } else {
+        /* no DT node: instantiated by board code or by the rk_sim harness */
+        struct gpio_keys_button *pdata = dev_get_platdata(&pdev->dev);
+
+        if (!pdata) {
+            pr_err("rk_button: no DT node and no platform data\n");
+            return -ENODEV;
+        }
+        button_name = pdata->desc;
+        button_gpio = pdata->gpio;
+        code = pdata->code;
+        active_low = pdata->active_low;
+        flag = IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING;
+    }
     if (!gpio_is_valid(button_gpio)) {
         pr_err("%s: button-gpio %d is invalid\n", button_name, button_gpio);
         return -ENODEV;
@@ -131,34 +535,57 @@ static int button_probe(struct platform_device *pdev)
         return -EFAULT;
     }
     init_waitqueue_head(&button_data->waitq);
+    spin_lock_init(&button_data->reflex_lock);
     button_data->gpio = button_gpio;
     button_data->irq  = button_irq;
     button_data->name = button_name;
     button_data->ev_press   = 0;
+    button_data->active_low = active_low;
+    /* idle level, so the first edge is seen as a change */
+    button_data->value = gpio_get_value(button_gpio);
+    if (input_bridge) {
+        if (button_input_add(button_data, code))
+            goto out_request_irq;
+    }
     button_data->misc.minor = MISC_DYNAMIC_MINOR;
     button_data->misc.name  = button_name;
     button_data->misc.fops  = &button_misc_fops;
+    button_data->window_start = jiffies;
+
+    init_timer(&button_data->timer);
+    button_data->timer.function = button_timeout_fun;
+    button_data->timer.data     = (unsigned long)button_data;
+    setup_timer(&button_data->poll_timer, button_poll_fun, (unsigned long)button_data);
 
     if (request_irq(button_irq, button_interrupt, flag, button_name, button_data)) {
         pr_err("%s: request_irq %d failed\n", button_name, button_irq);
         goto out_request_irq;
     }
 
+    /* attributes before the device node, so userspace never sees it without them */
+    platform_set_drvdata(pdev, button_data);
+    if (sysfs_create_group(&pdev->dev.kobj, &button_attr_group)) {
+        pr_err("%s: failed to create sysfs attributes\n", button_name);
+        goto out_sysfs_create;
+    }
+
     if (misc_register(&button_data->misc)) {
         pr_err("%s: misc_register error!\n", button_name);
         goto out_misc_register;
     }
-
-    init_timer(&button_data->timer);
-    button_data->timer.function = button_timeout_fun;
-    button_data->timer.data     = (unsigned long)button_data;
-
-    platform_set_drvdata(pdev, button_data);
     pr_err("===> %s: probe success\n", button_name);
     return 0;
 
 out_misc_register:
+    sysfs_remove_group(&pdev->dev.kobj, &button_attr_group);
+out_sysfs_create:
+    /* an edge may have armed either timer by now: stop both, as in remove */
+    disable_irq(button_irq);
+    del_timer_sync(&button_data->poll_timer);
+    if (button_data->storm)
+        enable_irq(button_irq);
     free_irq(button_irq, button_data);
+    del_timer_sync(&button_data->timer);
 out_request_irq:
     kfree(button_data);
     gpio_free(button_gpio);
@@ -169,9 +596,17 @@ static int button_remove(struct platform_device *pdev)
 {
     struct button_data *button_data = platform_get_drvdata(pdev);
 
-    del_timer(&button_data->timer);
-    misc_deregister(&button_data->misc);
+    sysfs_remove_group(&pdev->dev.kobj, &button_attr_group);
+    /* keep the irq from re-arming poll_timer while it is stopped */
+    disable_irq(button_data->irq);
+    del_timer_sync(&button_data->poll_timer);
+    if (button_data->storm)
+        enable_irq(button_data->irq);
     free_irq(button_data->irq, button_data);
+    del_timer_sync(&button_data->timer);
+    if (button_data->led_reflex)
+        symbol_put(rk_led_reflex);
+    misc_deregister(&button_data->misc);
     gpio_free(button_data->gpio);
     kfree(button_data);
     return 0;
@@ -189,17 +624,60 @@ static struct platform_driver rk_button = {
         .name   = "rk_button",
         .owner  = THIS_MODULE,
         .of_match_table = rk_button_of_match,
+        .probe_type = PROBE_PREFER_ASYNCHRONOUS,
     }
 };
 
+static int button_input_register(void)
+{
+    struct device_node *np;
+    unsigned int code;
+    int i;
+
+    /* declare every code known before probe, so probing rarely re-registers */
+    for (i = 0; i < nr_keymap; i++)
+        if (keymap[i] && keymap[i] <= KEY_MAX)
+            __set_bit(keymap[i], button_keybit);
+    for_each_matching_node(np, rk_button_of_match)
+        if (!of_property_read_u32(np, "linux,code", &code) &&
+            code && code <= KEY_MAX)
+            __set_bit(code, button_keybit);
+
+    button_input = button_input_create();
+    if (IS_ERR(button_input)) {
+        int err = PTR_ERR(button_input);
+
+        button_input = NULL;
+        return err;
+    }
+    return 0;
+}
+
 static int __init rk_button_init(void)
 {
-    return platform_driver_register(&rk_button);
+    int err;
+
+    if (input_bridge) {
+        err = button_input_register();
+        if (err) {
+            pr_err("rk_button: input device register failed\n");
+            return err;
+        }
+    }
+
+    err = platform_driver_register(&rk_button);
+    if (err && button_input)
+        input_unregister_device(button_input);
+    return err;
 }
 
 static void __exit rk_button_exit(void)
 {
     platform_driver_unregister(&rk_button);
+    if (button_input) {
+        tasklet_kill(&button_sync_tasklet);
+        input_unregister_device(button_input);
+    }
 }
 
 module_init(rk_button_init);
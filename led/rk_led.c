@@ -7,10 +7,25 @@
 #include <linux/uaccess.h>
 #include <linux/slab.h>
 #include <linux/delay.h>
+#include <linux/leds.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
+#include <linux/timer.h>
+#include <linux/workqueue.h>
+#include <linux/idr.h>
+#include <linux/device.h>
+
+#include "rk_led.h"
 
 static struct class *led_class;
 #define LED_CLASS "rk_led_class"
 
+/* one chrdev region for every LED, minors handed out at probe */
+#define LED_MAX_MINORS  (64)
+static dev_t led_devt;
+static DEFINE_IDA(led_minors);
+
 #define LED_ON_LEVEL    (1)
 #define LED_OFF_LEVEL   (0)
 
@@ -18,40 +33,386 @@ static struct class *led_class;
 #define IOCTL_LED_ON               _IO(LED_MAGIC, 1)
 #define IOCTL_LED_OFF              _IO(LED_MAGIC, 2)
 #define IOCTL_LED_SET_SHINE_CNT    _IOW(LED_MAGIC, 3, int)
+#define IOCTL_LED_SET_BRIGHTNESS   _IOW(LED_MAGIC, 4, int)
+#define IOCTL_LED_GET_BRIGHTNESS   _IOR(LED_MAGIC, 5, int)
+
+#define LED_MAX_BRIGHTNESS  (255)
+#define PWM_FREQ_MIN        (1)
+#define PWM_FREQ_MAX        (20000)
+
+static unsigned int pwm_freq = 200;
+module_param(pwm_freq, uint, 0644);
+MODULE_PARM_DESC(pwm_freq, "Software PWM frequency in Hz (1 ~ 20000)");
 
 struct led_data {
     unsigned int led_gpio;
+    bool active_low;
     const char *led_name;
     dev_t led_dev;
     struct cdev led_cdev;
+    unsigned int brightness;    /* light output, 0 ~ LED_MAX_BRIGHTNESS */
+    struct work_struct level_work;  /* 0/max level on a sleeping GPIO */
+    struct list_head pwm_node;  /* on pwm_leds while dimmed */
+    struct led_classdev led_classdev;
+    /* blink_set offload, see led_blink_fun() */
+    struct timer_list blink_timer;
+    spinlock_t blink_lock;      /* blink_* below */
+    bool blink_active;
+    bool blink_lit;                 /* in the first (blink_brightness) phase */
+    unsigned long blink_on_ms;
+    unsigned long blink_off_ms;
+    unsigned int blink_brightness;  /* first phase */
+    unsigned int blink_other;       /* second phase */
+    unsigned int blink_remaining;   /* first phases left, 0: forever */
+    unsigned int blink_restore;     /* brightness after the last one */
+    /* forever blink interrupted by a counted one, re-armed when it ends */
+    bool blink_resume;
+    unsigned long resume_on_ms;
+    unsigned long resume_off_ms;
+    unsigned int resume_brightness;
+    struct list_head node;          /* on led_list, for rk_led_reflex() */
 };
 
+/* every probed LED, looked up by name from rk_led_reflex() */
+static LIST_HEAD(led_list);
+static DEFINE_SPINLOCK(led_list_lock);
+
+static unsigned int reflex_blink_ms = 100;
+module_param(reflex_blink_ms, uint, 0644);
+MODULE_PARM_DESC(reflex_blink_ms, "On and off time of a reflex blink (ms)");
+
+/*
+ * Software PWM engine shared by all LEDs.
+ *
+ * pwm_leds holds every dimmed LED sorted by brightness. One hrtimer switches
+ * all of them on at the start of a period and then steps through the list,
+ * switching off every LED whose duty has elapsed, so LEDs that share a
+ * brightness also share an interrupt. 0 and LED_MAX_BRIGHTNESS are plain
+ * GPIO levels and never enter the list.
+ */
+static LIST_HEAD(pwm_leds);
+static DEFINE_SPINLOCK(pwm_lock);       /* pwm_leds, pwm_next, brightness */
+static struct hrtimer pwm_timer;
+static struct led_data *pwm_next;       /* next to switch off, NULL: new period */
+static ktime_t pwm_period_start;
+static u64 pwm_period_ns;
+
+/* on/off in terms of light, the pin level follows the DT polarity */
+static void led_gpio_set(struct led_data *led_data, int on)
+{
+    gpio_set_value(led_data->led_gpio,
+                   (on ? LED_ON_LEVEL : LED_OFF_LEVEL) ^ led_data->active_low);
+}
+
+static void led_level_work(struct work_struct *work)
+{
+    struct led_data *led_data = container_of(work, struct led_data, level_work);
+    int on = READ_ONCE(led_data->brightness) != 0;
+
+    gpio_set_value_cansleep(led_data->led_gpio,
+                            (on ? LED_ON_LEVEL : LED_OFF_LEVEL) ^ led_data->active_low);
+}
+
+static u64 pwm_duty_ns(unsigned int brightness)
+{
+    return div_u64(pwm_period_ns * brightness, LED_MAX_BRIGHTNESS);
+}
+
+static enum hrtimer_restart pwm_timer_fun(struct hrtimer *hrt)
+{
+    struct led_data *led_data;
+    unsigned long flags;
+    ktime_t now = hrtimer_get_expires(hrt);
+    u64 elapsed;
+
+    spin_lock_irqsave(&pwm_lock, flags);
+    if (list_empty(&pwm_leds)) {
+        spin_unlock_irqrestore(&pwm_lock, flags);
+        return HRTIMER_NORESTART;
+    }
+
+    if (!pwm_next) {
+        /* start of a period: every dimmed LED goes on */
+        pwm_period_ns = NSEC_PER_SEC /
+                clamp_t(unsigned int, READ_ONCE(pwm_freq), PWM_FREQ_MIN, PWM_FREQ_MAX);
+        /* don't try to catch up on periods we have already missed */
+        if (ktime_before(ktime_add_ns(now, pwm_period_ns), ktime_get()))
+            now = ktime_get();
+        pwm_period_start = now;
+        list_for_each_entry(led_data, &pwm_leds, pwm_node)
+            led_gpio_set(led_data, 1);
+        pwm_next = list_first_entry(&pwm_leds, struct led_data, pwm_node);
+    }
+
+    /* off edge: every LED whose duty has elapsed goes off */
+    elapsed = ktime_to_ns(ktime_sub(now, pwm_period_start));
+    while (pwm_next && pwm_duty_ns(pwm_next->brightness) <= elapsed) {
+        led_gpio_set(pwm_next, 0);
+        if (list_is_last(&pwm_next->pwm_node, &pwm_leds))
+            pwm_next = NULL;
+        else
+            pwm_next = list_next_entry(pwm_next, pwm_node);
+    }
+
+    if (pwm_next)
+        hrtimer_set_expires(hrt, ktime_add_ns(pwm_period_start,
+                                              pwm_duty_ns(pwm_next->brightness)));
+    else
+        hrtimer_set_expires(hrt, ktime_add_ns(pwm_period_start, pwm_period_ns));
+    spin_unlock_irqrestore(&pwm_lock, flags);
+
+    return HRTIMER_RESTART;
+}
+
+static int led_pwm_set(struct led_data *led_data, unsigned int brightness)
+{
+    struct led_data *pos;
+    unsigned long flags;
+
+    if (brightness > LED_MAX_BRIGHTNESS)
+        return -EINVAL;
+    /* the PWM edges are driven from hardirq context */
+    if (brightness && brightness < LED_MAX_BRIGHTNESS &&
+        gpio_cansleep(led_data->led_gpio))
+        return -EOPNOTSUPP;
+
+    spin_lock_irqsave(&pwm_lock, flags);
+    if (!list_empty(&led_data->pwm_node))
+        list_del_init(&led_data->pwm_node);
+    led_data->brightness = brightness;
+
+    if (brightness == 0 || brightness == LED_MAX_BRIGHTNESS) {
+        /* under pwm_lock, so concurrent setters cannot land out of order */
+        if (!gpio_cansleep(led_data->led_gpio))
+            led_gpio_set(led_data, brightness);
+    } else {
+        list_for_each_entry(pos, &pwm_leds, pwm_node)
+            if (pos->brightness > brightness)
+                break;
+        list_add_tail(&led_data->pwm_node, &pos->pwm_node);
+    }
+
+    /* the list changed under the cursor: restart the period now */
+    pwm_next = NULL;
+    if (!list_empty(&pwm_leds))
+        hrtimer_start(&pwm_timer, ktime_get(), HRTIMER_MODE_ABS);
+    spin_unlock_irqrestore(&pwm_lock, flags);
+
+    /* callers may be atomic (triggers, blink timer): defer sleeping GPIOs */
+    if ((brightness == 0 || brightness == LED_MAX_BRIGHTNESS) &&
+        gpio_cansleep(led_data->led_gpio))
+        schedule_work(&led_data->level_work);
+
+    return 0;
+}
+
+static void led_blink_arm(struct led_data *led_data, unsigned long on_ms,
+        unsigned long off_ms, unsigned int first, unsigned int other,
+        unsigned int count);
+
+static void led_blink_fun(unsigned long data)
+{
+    struct led_data *led_data = (struct led_data *)data;
+    unsigned long flags, delay;
+
+    spin_lock_irqsave(&led_data->blink_lock, flags);
+    if (led_data->blink_active) {
+        led_data->blink_lit = !led_data->blink_lit;
+        if (!led_data->blink_lit && led_data->blink_remaining &&
+            !--led_data->blink_remaining) {
+            /* counted blink done */
+            if (led_data->blink_resume) {
+                /* back to the LED-class blink it interrupted */
+                led_data->blink_resume = false;
+                led_blink_arm(led_data, led_data->resume_on_ms,
+                              led_data->resume_off_ms,
+                              led_data->resume_brightness, 0, 0);
+                goto out;
+            }
+            led_data->blink_active = false;
+            led_pwm_set(led_data, led_data->blink_restore);
+            goto out;
+        }
+        delay = led_data->blink_lit ? led_data->blink_on_ms : led_data->blink_off_ms;
+        led_pwm_set(led_data, led_data->blink_lit ?
+                    led_data->blink_brightness : led_data->blink_other);
+        mod_timer(&led_data->blink_timer, jiffies + msecs_to_jiffies(delay));
+    }
+out:
+    spin_unlock_irqrestore(&led_data->blink_lock, flags);
+}
+
+/*
+ * Alternate between first and other, starting with first; after count first
+ * phases go back to the brightness from before the blink, count 0: forever.
+ * Called with blink_lock held.
+ */
+static void led_blink_arm(struct led_data *led_data, unsigned long on_ms,
+        unsigned long off_ms, unsigned int first, unsigned int other,
+        unsigned int count)
+{
+    if (!led_data->blink_active)
+        led_data->blink_restore = led_data->brightness;
+    led_data->blink_remaining = count;
+    led_data->blink_active = true;
+    led_data->blink_lit = true;
+    led_data->blink_on_ms = on_ms;
+    led_data->blink_off_ms = off_ms;
+    led_data->blink_brightness = first;
+    led_data->blink_other = other;
+    led_pwm_set(led_data, first);
+    mod_timer(&led_data->blink_timer, jiffies + msecs_to_jiffies(on_ms));
+}
+
+static void led_blink_start(struct led_data *led_data, unsigned long on_ms,
+        unsigned long off_ms, unsigned int brightness)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&led_data->blink_lock, flags);
+    led_data->blink_resume = false;
+    led_blink_arm(led_data, on_ms, off_ms, brightness, 0, 0);
+    spin_unlock_irqrestore(&led_data->blink_lock, flags);
+}
+
+/* count visible blinks relative to the resting state: a lit LED goes dark */
+static void led_blink_flash(struct led_data *led_data, unsigned long ms,
+        unsigned int count)
+{
+    unsigned long flags;
+    unsigned int base;
+
+    spin_lock_irqsave(&led_data->blink_lock, flags);
+    if (led_data->blink_active && !led_data->blink_remaining) {
+        led_data->blink_resume = true;
+        led_data->resume_on_ms = led_data->blink_on_ms;
+        led_data->resume_off_ms = led_data->blink_off_ms;
+        led_data->resume_brightness = led_data->blink_brightness;
+    }
+    base = led_data->blink_active ? led_data->blink_restore : led_data->brightness;
+    led_blink_arm(led_data, ms, ms, base ? 0 : LED_MAX_BRIGHTNESS, base, count);
+    spin_unlock_irqrestore(&led_data->blink_lock, flags);
+}
+
+static void led_blink_stop(struct led_data *led_data)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&led_data->blink_lock, flags);
+    led_data->blink_active = false;
+    led_data->blink_resume = false;
+    del_timer(&led_data->blink_timer);
+    spin_unlock_irqrestore(&led_data->blink_lock, flags);
+}
+
+/* an explicit brightness from any interface cancels blinking */
+static int led_set_brightness(struct led_data *led_data, unsigned int brightness)
+{
+    led_blink_stop(led_data);
+    return led_pwm_set(led_data, brightness);
+}
+
+static void led_class_brightness_set(struct led_classdev *led_cdev,
+        enum led_brightness value)
+{
+    struct led_data *led_data = container_of(led_cdev, struct led_data, led_classdev);
+
+    led_set_brightness(led_data, value);
+}
+
+static enum led_brightness led_class_brightness_get(struct led_classdev *led_cdev)
+{
+    struct led_data *led_data = container_of(led_cdev, struct led_data, led_classdev);
+
+    return led_data->brightness;
+}
+
+/* offload of the LED core's software blink, e.g. for the timer trigger */
+static int led_class_blink_set(struct led_classdev *led_cdev,
+        unsigned long *delay_on, unsigned long *delay_off)
+{
+    struct led_data *led_data = container_of(led_cdev, struct led_data, led_classdev);
+    unsigned int brightness = led_cdev->blink_brightness ? : LED_MAX_BRIGHTNESS;
+
+    if (!*delay_on && !*delay_off) {
+        *delay_on = 500;
+        *delay_off = 500;
+    }
+
+    if (!*delay_on)
+        return led_set_brightness(led_data, 0);
+    if (!*delay_off)
+        return led_set_brightness(led_data, brightness);
+
+    led_blink_start(led_data, *delay_on, *delay_off, brightness);
+    return 0;
+}
+
+/*
+ * Entry point for rk_button's reflex bindings: runs straight from the
+ * button debounce timer, so it must not sleep.
+ */
+int rk_led_reflex(const char *name, unsigned int action, unsigned int count)
+{
+    struct led_data *led_data;
+    unsigned long flags;
+    int ret = -ENODEV;
+
+    spin_lock_irqsave(&led_list_lock, flags);
+    list_for_each_entry(led_data, &led_list, node) {
+        if (strcmp(led_data->led_name, name))
+            continue;
+
+        switch (action) {
+        case RK_LED_REFLEX_SET:
+            ret = led_set_brightness(led_data, LED_MAX_BRIGHTNESS);
+            break;
+        case RK_LED_REFLEX_CLEAR:
+            ret = led_set_brightness(led_data, 0);
+            break;
+        case RK_LED_REFLEX_TOGGLE:
+            ret = led_set_brightness(led_data,
+                                     led_data->brightness ? 0 : LED_MAX_BRIGHTNESS);
+            break;
+        case RK_LED_REFLEX_BLINK:
+            led_blink_flash(led_data, reflex_blink_ms, count ? : 1);
+            ret = 0;
+            break;
+        default:
+            ret = -EINVAL;
+            break;
+        }
+        break;
+    }
+    spin_unlock_irqrestore(&led_list_lock, flags);
+
+    return ret;
+}
+EXPORT_SYMBOL_GPL(rk_led_reflex);
+
 static long led_ioctl(struct file *file, unsigned int cmd, unsigned long cnt)
 {
     struct led_data *led_data = file->private_data;
 
     switch (cmd) {
     case IOCTL_LED_ON:
-        gpio_set_value(led_data->led_gpio, LED_ON_LEVEL);
-        pr_err("====> %s: led_ioctl on!\n", led_data->led_name);
+        led_set_brightness(led_data, LED_MAX_BRIGHTNESS);
+        pr_debug("====> %s: led_ioctl on!\n", led_data->led_name);
         break;
     case IOCTL_LED_OFF:
-        gpio_set_value(led_data->led_gpio, LED_OFF_LEVEL);
-        pr_err("====> %s: led_ioctl off!\n", led_data->led_name);
+        led_set_brightness(led_data, 0);
+        pr_debug("====> %s: led_ioctl off!\n", led_data->led_name);
         break;
+    case IOCTL_LED_SET_BRIGHTNESS:
+        return led_set_brightness(led_data, cnt);
+    case IOCTL_LED_GET_BRIGHTNESS:
+        return put_user(led_data->brightness, (int __user *)cnt);
     case IOCTL_LED_SET_SHINE_CNT:
-    {
-        int i, val = gpio_get_value(led_data->led_gpio);
-
-        pr_err("====> %s: led_ioctl set shine count %ld!\n", led_data->led_name, cnt);
-        for (i = 0; i < cnt; i++) {
-            gpio_set_value(led_data->led_gpio, !val);
-            mdelay(500);
-            gpio_set_value(led_data->led_gpio, val);
-            mdelay(500);
-        }
+        pr_debug("====> %s: led_ioctl set shine count %ld!\n", led_data->led_name, cnt);
+        /* through the blink engine, not the raw pin: PWM and blink stay in step */
+        if (cnt)
+            led_blink_flash(led_data, 500, cnt);
         break;
-    }
     default:
         break;
     }
@@ -65,9 +426,8 @@ static ssize_t led_read(struct file *file, char __user *ubuf,
     char kbuf[8] = { 0 };
     struct led_data *led_data = file->private_data;
 
-    gpio_direction_input(led_data->led_gpio);
-    val = gpio_get_value(led_data->led_gpio);
-    gpio_direction_output(led_data->led_gpio, val);
+    /* light on/off, like write(): not the pin level, not the PWM phase */
+    val = led_data->brightness != 0;
 
     if (*offset >= min(sizeof(kbuf), count))
         return 0;
@@ -95,8 +455,8 @@ static ssize_t led_write(struct file *file, const char __user *ubuf,
         pr_err("kstrtoint error!\n");
         return -EINVAL;
     }
-    pr_err("====> %s: val = %d\n", led_data->led_name, val);
-    gpio_set_value(led_data->led_gpio, val);
+    pr_debug("====> %s: val = %d\n", led_data->led_name, val);
+    led_set_brightness(led_data, val ? LED_MAX_BRIGHTNESS : 0);
     return min(sizeof(kbuf), count);
 }
 
@@ -124,79 +484,127 @@ static const struct file_operations led_fops = {
     .compat_ioctl       = led_ioctl,
 };
 
+static void led_cdev_release(void *data)
+{
+    struct led_data *led_data = data;
+
+    device_destroy(led_class, led_data->led_dev);
+    cdev_del(&led_data->led_cdev);
+    ida_simple_remove(&led_minors, MINOR(led_data->led_dev));
+}
+
 static int led_probe(struct platform_device *pdev)
 {
-    int ret;
+    int ret, minor;
     unsigned int led_gpio;
     enum of_gpio_flags flag;
     const char *led_name;
-    dev_t led_dev;
-    struct led_data *led_data = NULL;
-    struct device_node *np = pdev->dev.of_node;
-
-    of_property_read_string(np, "led_name", &led_name);
-
-    led_gpio = of_get_named_gpio_flags(np, "led_gpio", 0, &flag);
+    struct led_data *led_data;
+    struct device *dev = &pdev->dev;
+    struct device_node *np = dev->of_node;
+
+    if (np) {
+        of_property_read_string(np, "led_name", &led_name);
+        led_gpio = of_get_named_gpio_flags(np, "led_gpio", 0, &flag);
+    } else {
+        /* no DT node: instantiated by board code or by the rk_sim harness */
+        struct gpio_led *pdata = dev_get_platdata(dev);
+
+        if (!pdata) {
+            dev_err(dev, "no DT node and no platform data\n");
+            return -ENODEV;
+        }
+        led_name = pdata->name;
+        led_gpio = pdata->gpio;
+        flag = pdata->active_low ? OF_GPIO_ACTIVE_LOW : 0;
+    }
     if (!gpio_is_valid(led_gpio)) {
-        pr_err("%s: led-gpio %d is invalid\n", led_name, led_gpio);
+        dev_err(dev, "%s: led-gpio %d is invalid\n", led_name, led_gpio);
         return -ENODEV;
     }
-    if (gpio_request(led_gpio, led_name)) {
-        pr_err("%s: gpio %d request failed!\n", led_name, led_gpio);
-        return -ENODEV;
+    ret = devm_gpio_request_one(dev, led_gpio, (flag == OF_GPIO_ACTIVE_LOW) ?
+                                GPIOF_OUT_INIT_LOW : GPIOF_OUT_INIT_HIGH, led_name);
+    if (ret) {
+        dev_err(dev, "%s: gpio %d request failed!\n", led_name, led_gpio);
+        return ret;
     }
-    gpio_direction_output(led_gpio, (flag == OF_GPIO_ACTIVE_LOW) ? 0 : 1);
 
-    ret = alloc_chrdev_region(&led_dev, 0, 1, led_name);
-    if (ret < 0) {
-        pr_err("register_chrdev %s failed!\n", led_name);
-        goto out_alloc_chrdev;
-    }
+    led_data = devm_kzalloc(dev, sizeof(*led_data), GFP_KERNEL);
+    if (!led_data)
+        return -ENOMEM;
+
+    INIT_LIST_HEAD(&led_data->pwm_node);
+    INIT_WORK(&led_data->level_work, led_level_work);
+    led_data->active_low = (flag == OF_GPIO_ACTIVE_LOW);
+    /* the GPIO was requested at its active level: the LED starts lit */
+    led_data->brightness = LED_MAX_BRIGHTNESS;
+    spin_lock_init(&led_data->blink_lock);
+    setup_timer(&led_data->blink_timer, led_blink_fun, (unsigned long)led_data);
+    led_data->led_gpio = led_gpio;
+    led_data->led_name = led_name;
 
-    led_data = kzalloc(sizeof(*led_data), GFP_KERNEL);
-    if (!led_data) {
-        pr_err("could not allocate led_data!\n");
-        goto out_kzalloc;
+    /* one minor of the shared rk_led region per LED */
+    minor = ida_simple_get(&led_minors, 0, LED_MAX_MINORS, GFP_KERNEL);
+    if (minor < 0) {
+        dev_err(dev, "%s: no free minor\n", led_name);
+        return minor;
     }
+    led_data->led_dev = MKDEV(MAJOR(led_devt), minor);
 
     cdev_init(&led_data->led_cdev, &led_fops);
     led_data->led_cdev.owner = THIS_MODULE;
-    ret = cdev_add(&led_data->led_cdev, led_dev, 1);
+    ret = cdev_add(&led_data->led_cdev, led_data->led_dev, 1);
     if (ret < 0) {
-        pr_err("%s cdev_add error!\n", led_name);
-        goto out_cdev_add;
+        dev_err(dev, "%s cdev_add error!\n", led_name);
+        ida_simple_remove(&led_minors, minor);
+        return ret;
     }
+    device_create(led_class, NULL, led_data->led_dev, NULL, led_name);
 
-    device_create(led_class, NULL, led_dev, NULL, led_name);
+    ret = devm_add_action(dev, led_cdev_release, led_data);
+    if (ret) {
+        led_cdev_release(led_data);
+        return ret;
+    }
 
-    led_data->led_dev  = led_dev;
-    led_data->led_gpio = led_gpio;
-    led_data->led_name = led_name;
     platform_set_drvdata(pdev, led_data);
 
-    pr_err("=========> %s probe success!\n", led_data->led_name);
-    return 0;
+    /* also expose the LED to the kernel LED class and its triggers */
+    led_data->led_classdev.name            = led_name;
+    led_data->led_classdev.max_brightness  = LED_MAX_BRIGHTNESS;
+    led_data->led_classdev.brightness      = led_data->brightness;
+    led_data->led_classdev.brightness_set  = led_class_brightness_set;
+    led_data->led_classdev.brightness_get  = led_class_brightness_get;
+    led_data->led_classdev.blink_set       = led_class_blink_set;
+    ret = led_classdev_register(dev, &led_data->led_classdev);
+    if (ret < 0) {
+        dev_err(dev, "%s led_classdev_register error!\n", led_name);
+        return ret;
+    }
 
-out_cdev_add:
-    kfree(led_data);
-out_kzalloc:
-    unregister_chrdev_region(led_dev, 1);
-out_alloc_chrdev:
-    gpio_free(led_gpio);
-    return -EINVAL;
+    spin_lock_irq(&led_list_lock);
+    list_add_tail(&led_data->node, &led_list);
+    spin_unlock_irq(&led_list_lock);
+
+    dev_dbg(dev, "%s probe success!\n", led_name);
+    return 0;
 }
 
+/* gpio, cdev and led_data itself are devm-managed and go after this */
 static int led_remove(struct platform_device *pdev)
 {
     struct led_data *led_data = platform_get_drvdata(pdev);
 
-    device_destroy(led_class, led_data->led_dev);
-    cdev_del(&led_data->led_cdev);
-    unregister_chrdev_region(led_data->led_dev, 1);
-    gpio_free(led_data->led_gpio);
-    kfree(led_data);
+    spin_lock_irq(&led_list_lock);
+    list_del(&led_data->node);
+    spin_unlock_irq(&led_list_lock);
 
-    pr_err("=========> %s remove success!\n", led_data->led_name);
+    led_classdev_unregister(&led_data->led_classdev);
+    led_set_brightness(led_data, 0);
+    del_timer_sync(&led_data->blink_timer);
+    flush_work(&led_data->level_work);
+
+    dev_dbg(&pdev->dev, "%s remove success!\n", led_data->led_name);
     return 0;
 }
 
@@ -214,23 +622,48 @@ static struct platform_driver rk_led = {
         .name = "rk_led",
         .owner = THIS_MODULE,
         .of_match_table = rk_led_of_match,
+        .probe_type = PROBE_PREFER_ASYNCHRONOUS,
     }
 };
 
 static int __init rk_led_init(void)
 {
+    int ret;
+
+    ret = alloc_chrdev_region(&led_devt, 0, LED_MAX_MINORS, "rk_led");
+    if (ret < 0) {
+        pr_err("alloc_chrdev_region rk_led failed!\n");
+        return ret;
+    }
+
     led_class = class_create(THIS_MODULE, LED_CLASS);
     if (IS_ERR(led_class)) {
         pr_err("class create %s failed!\n", LED_CLASS);
-        return -EINVAL;
+        ret = PTR_ERR(led_class);
+        goto out_class_create;
     }
-    return platform_driver_register(&rk_led);
+    hrtimer_init(&pwm_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    pwm_timer.function = pwm_timer_fun;
+
+    ret = platform_driver_register(&rk_led);
+    if (ret)
+        goto out_driver_register;
+    return 0;
+
+out_driver_register:
+    class_destroy(led_class);
+out_class_create:
+    unregister_chrdev_region(led_devt, LED_MAX_MINORS);
+    return ret;
 }
 
 static void __exit rk_led_exit(void)
 {
     platform_driver_unregister(&rk_led);
+    hrtimer_cancel(&pwm_timer);
     class_destroy(led_class);
+    unregister_chrdev_region(led_devt, LED_MAX_MINORS);
+    ida_destroy(&led_minors);
 }
 
 module_init(rk_led_init);
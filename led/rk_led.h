@@ -0,0 +1,16 @@
+#ifndef __RK_LED_H__
+#define __RK_LED_H__
+
+/* actions of rk_led_reflex() */
+#define RK_LED_REFLEX_SET       (0)
+#define RK_LED_REFLEX_CLEAR     (1)
+#define RK_LED_REFLEX_TOGGLE    (2)
+#define RK_LED_REFLEX_BLINK     (3)     /* count blinks against the current state */
+
+/*
+ * Run an LED action by LED name without sleeping, e.g. from rk_button's
+ * debounce timer. Returns -ENODEV when no such LED is probed.
+ */
+int rk_led_reflex(const char *name, unsigned int action, unsigned int count);
+
+#endif /* __RK_LED_H__ */
@@ -0,0 +1,252 @@
+/*
+ * Hardware-free bed for rk_led, rk_button and rk_timer2.
+ *
+ * rk_led and rk_button are bound to GPIO lines given by number (gpio-mockup
+ * lines on a 4.9 ~ 4.14 development kernel, see README.md), rk_timer2 runs
+ * against a register block in RAM that is counted down by an hrtimer and
+ * raises a software IRQ on expiry, the same way the real timer reloads from
+ * load_cnt.
+ *
+ * The emulated counter only moves in tick_us steps (50us by default), so on
+ * this bed the irq latency rk_timer2 derives from load - curr is the tick
+ * overshoot, spread over 0..tick_us, not ISR latency, and counter-mode
+ * RK_TIMER_WAIT has tick_us granularity.  While ctlreg bit0 is clear the
+ * channel is only polled every SIM_IDLE_POLL_MS, which keeps the bed's own
+ * interrupt load out of idle runs but delays the start of counting, and so
+ * the first tick, by up to that long.
+ *
+ *   insmod rk_sim.ko led_gpios=496,497,498 button_gpios=499 timer=1
+ */
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/platform_device.h>
+#include <linux/leds.h>
+#include <linux/gpio_keys.h>
+#include <linux/hrtimer.h>
+#include <linux/interrupt.h>
+#include <linux/irq.h>
+#include <linux/ktime.h>
+
+#define SIM_MAX_GPIOS   (8)
+#define SIM_IDLE_POLL_MS (10)   /* tick period while the channel is disabled */
+
+/* must match struct rk_timer_reg in timer/rk_timer.c */
+struct rk_timer_reg {
+    unsigned int load_cnt0;
+    unsigned int load_cnt1;
+    unsigned int curr_val0;
+    unsigned int curr_val1;
+    unsigned int load_cnt2;
+    unsigned int load_cnt3;
+    unsigned int stat;
+    unsigned int ctlreg;
+};
+
+static int led_gpios[SIM_MAX_GPIOS];
+static int nr_led_gpios;
+module_param_array(led_gpios, int, &nr_led_gpios, 0444);
+MODULE_PARM_DESC(led_gpios, "GPIO numbers to bind rk_led instances to");
+
+static int button_gpios[SIM_MAX_GPIOS];
+static int nr_button_gpios;
+module_param_array(button_gpios, int, &nr_button_gpios, 0444);
+MODULE_PARM_DESC(button_gpios, "GPIO numbers to bind rk_button instances to");
+
+static bool timer = true;
+module_param(timer, bool, 0444);
+MODULE_PARM_DESC(timer, "Register an emulated rk_timer2");
+
+static unsigned int tick_us = 50;
+module_param(tick_us, uint, 0444);
+MODULE_PARM_DESC(tick_us, "Resolution of the emulated timer counter (us)");
+
+static struct platform_device *led_pdev[SIM_MAX_GPIOS];
+static struct platform_device *button_pdev[SIM_MAX_GPIOS];
+static char led_names[SIM_MAX_GPIOS][16];
+static char button_names[SIM_MAX_GPIOS][16];
+
+static struct platform_device *timer_pdev;
+static struct rk_timer_reg *timer_reg;
+static struct hrtimer timer_tick;
+static int timer_irq = -1;
+static bool timer_running;
+static unsigned long timer_expiries;
+
+/*
+ * Model of one timer channel: ctlreg bit0 enables counting and loads curr_val
+ * from load_cnt, bit1 clear selects free-running (auto reload), bit2 unmasks
+ * the interrupt.  stat is set on every expiry.
+ */
+static enum hrtimer_restart timer_tick_fun(struct hrtimer *hrt)
+{
+    u64 load, curr, step = 24ULL * tick_us;     /* clock: 24MHz */
+    bool expired = false;
+    unsigned int ctl = READ_ONCE(timer_reg->ctlreg);
+
+    load = ((u64)READ_ONCE(timer_reg->load_cnt1) << 32) |
+            READ_ONCE(timer_reg->load_cnt0);
+
+    if (!(ctl & 0x01) || !load) {
+        timer_running = false;
+        hrtimer_forward_now(hrt, ns_to_ktime(SIM_IDLE_POLL_MS * NSEC_PER_MSEC));
+        return HRTIMER_RESTART;
+    }
+    hrtimer_forward_now(hrt, ns_to_ktime(tick_us * NSEC_PER_USEC));
+
+    if (!timer_running) {
+        timer_running = true;
+        curr = load;
+    } else {
+        curr = ((u64)READ_ONCE(timer_reg->curr_val1) << 32) |
+                READ_ONCE(timer_reg->curr_val0);
+        if (curr > step) {
+            curr -= step;
+        } else {
+            curr = load - (step - curr) % load;
+            expired = true;
+            timer_expiries++;
+            if (ctl & (0x01 << 1)) {        /* user-defined count: one shot */
+                WRITE_ONCE(timer_reg->ctlreg, ctl & ~0x01);
+                curr = 0;
+            }
+        }
+    }
+
+    WRITE_ONCE(timer_reg->curr_val0, curr & 0xFFFFFFFF);
+    WRITE_ONCE(timer_reg->curr_val1, curr >> 32);
+
+    /* reload first, then interrupt: the ISR reads the reloaded counter */
+    if (expired) {
+        WRITE_ONCE(timer_reg->stat, 1);
+        if (ctl & (0x01 << 2))
+            generic_handle_irq(timer_irq);
+    }
+    return HRTIMER_RESTART;
+}
+
+static int sim_timer_add(void)
+{
+    struct rk_timer_reg zero = { 0 };
+    struct resource res;
+    int err;
+
+    timer_irq = irq_alloc_desc(numa_node_id());
+    if (timer_irq < 0) {
+        pr_err("rk_sim: irq_alloc_desc failed\n");
+        return timer_irq;
+    }
+    irq_set_chip_and_handler(timer_irq, &dummy_irq_chip, handle_simple_irq);
+    irq_modify_status(timer_irq, IRQ_NOREQUEST | IRQ_NOAUTOEN, IRQ_NOPROBE);
+
+    memset(&res, 0, sizeof(res));
+    res.start = timer_irq;
+    res.end   = timer_irq;
+    res.flags = IORESOURCE_IRQ;
+
+    /* the platform device owns the register block (its platform data) */
+    timer_pdev = platform_device_register_resndata(NULL, "rk_timer2", -1,
+                                                   &res, 1, &zero, sizeof(zero));
+    if (IS_ERR(timer_pdev)) {
+        err = PTR_ERR(timer_pdev);
+        pr_err("rk_sim: register rk_timer2 failed\n");
+        irq_free_desc(timer_irq);
+        return err;
+    }
+    timer_reg = dev_get_platdata(&timer_pdev->dev);
+
+    hrtimer_init(&timer_tick, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    timer_tick.function = timer_tick_fun;
+    hrtimer_start(&timer_tick, ns_to_ktime(tick_us * NSEC_PER_USEC),
+                  HRTIMER_MODE_REL);
+    return 0;
+}
+
+static void sim_timer_del(void)
+{
+    hrtimer_cancel(&timer_tick);
+    platform_device_unregister(timer_pdev);
+    irq_free_desc(timer_irq);
+    pr_info("rk_sim: emulated rk_timer2 expired %lu times\n", timer_expiries);
+}
+
+static void sim_gpio_del(void)
+{
+    int i;
+
+    for (i = 0; i < SIM_MAX_GPIOS; i++) {
+        if (!IS_ERR_OR_NULL(button_pdev[i]))
+            platform_device_unregister(button_pdev[i]);
+        if (!IS_ERR_OR_NULL(led_pdev[i]))
+            platform_device_unregister(led_pdev[i]);
+    }
+}
+
+static int sim_gpio_add(void)
+{
+    int i;
+
+    for (i = 0; i < nr_led_gpios; i++) {
+        struct gpio_led led = { 0 };
+
+        snprintf(led_names[i], sizeof(led_names[i]), "led_sim%d", i);
+        led.name = led_names[i];
+        led.gpio = led_gpios[i];
+        led_pdev[i] = platform_device_register_data(NULL, "rk_led", i,
+                                                    &led, sizeof(led));
+        if (IS_ERR(led_pdev[i])) {
+            pr_err("rk_sim: register rk_led on gpio %d failed\n", led.gpio);
+            return PTR_ERR(led_pdev[i]);
+        }
+    }
+
+    for (i = 0; i < nr_button_gpios; i++) {
+        struct gpio_keys_button button = { 0 };
+
+        snprintf(button_names[i], sizeof(button_names[i]), "button_sim%d", i);
+        button.desc = button_names[i];
+        button.gpio = button_gpios[i];
+        button_pdev[i] = platform_device_register_data(NULL, "rk_button", i,
+                                                       &button, sizeof(button));
+        if (IS_ERR(button_pdev[i])) {
+            pr_err("rk_sim: register rk_button on gpio %d failed\n",
+                   button.gpio);
+            return PTR_ERR(button_pdev[i]);
+        }
+    }
+
+    return 0;
+}
+
+static int __init rk_sim_init(void)
+{
+    int err;
+
+    err = sim_gpio_add();
+    if (err)
+        goto err_gpio;
+
+    if (timer) {
+        err = sim_timer_add();
+        if (err)
+            goto err_gpio;
+    }
+    return 0;
+
+err_gpio:
+    sim_gpio_del();
+    return err;
+}
+
+static void __exit rk_sim_exit(void)
+{
+    if (timer)
+        sim_timer_del();
+    sim_gpio_del();
+}
+
+module_init(rk_sim_init);
+module_exit(rk_sim_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Ifan Tsai <i@caiyifan.cn>");
+MODULE_DESCRIPTION("hardware-free test bed for the rk3399 drivers");
@@ -15,13 +15,97 @@
 #include <linux/of_irq.h>
 #include <linux/of.h>
 #include <linux/of_address.h>
+#include <linux/pm_runtime.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/log2.h>
+#include <linux/hrtimer.h>
 
 #define RK_DEV_MAX   (1)
 
+/* programmable interval: 1ms ~ 10s */
+#define RK_TIMER_INTERVAL_MIN_US (1000)
+#define RK_TIMER_INTERVAL_MAX_US (10000000)
+
+static int autosuspend_ms = 100;
+module_param(autosuspend_ms, int, 0444);
+MODULE_PARM_DESC(autosuspend_ms, "Idle time before the timer clocks are gated (ms)");
+
+/*
+ * Bound on resume latency (RK_TIMER_START -> counter running, and the first
+ * tick's lateness). The default is the shortest interval, so a late first
+ * tick never runs into the next one; crossings are counted and logged.
+ */
+static unsigned int resume_latency_limit_us = RK_TIMER_INTERVAL_MIN_US;
+module_param(resume_latency_limit_us, uint, 0644);
+MODULE_PARM_DESC(resume_latency_limit_us, "Resume latency reported as exceeded above this (us)");
+
+/* RK_TIMER_WAIT spins with preemption off: never let it exceed this */
+#define RK_TIMER_SPIN_US_LIMIT   (1000)
+
+static unsigned int max_spin_us = 200;
+
+static int max_spin_us_set(const char *val, const struct kernel_param *kp)
+{
+    unsigned int us;
+    int err = kstrtouint(val, 0, &us);
+
+    if (err)
+        return err;
+    if (us > RK_TIMER_SPIN_US_LIMIT)
+        return -EINVAL;
+    *(unsigned int *)kp->arg = us;
+    return 0;
+}
+
+static const struct kernel_param_ops max_spin_us_ops = {
+    .set = max_spin_us_set,
+    .get = param_get_uint,
+};
+module_param_cb(max_spin_us, &max_spin_us_ops, &max_spin_us, 0644);
+MODULE_PARM_DESC(max_spin_us, "Upper bound of the RK_TIMER_WAIT busy-poll budget (us, <= 1000)");
+
 #define RK_TIMER_MAGIC           't'
 #define RK_TIMER_START           _IO(RK_TIMER_MAGIC, 0x01)
 #define RK_TIMER_STOP            _IO(RK_TIMER_MAGIC, 0x02)
 #define RK_TIMER_SET_INTERVAL    _IOW(RK_TIMER_MAGIC, 0x03, unsigned int)
+#define RK_TIMER_GET_LATENCY     _IOR(RK_TIMER_MAGIC, 0x04, struct rk_timer_latency)
+#define RK_TIMER_RESET_LATENCY   _IO(RK_TIMER_MAGIC, 0x05)
+#define RK_TIMER_WAIT            _IOWR(RK_TIMER_MAGIC, 0x06, struct rk_timer_wait)
+
+/* rk_timer_wait.mode */
+#define RK_TIMER_WAIT_DEADLINE   (0)    /* target: CLOCK_MONOTONIC ns */
+#define RK_TIMER_WAIT_COUNTER    (1)    /* target: curr_val of the running timer */
+
+/*
+ * Sleep until spin_ns before the target, then busy-poll the rest of the way.
+ * error_ns returns how late (or, if negative, early) the wait ended.
+ */
+struct rk_timer_wait {
+    __u32 mode;
+    __u32 spin_ns;
+    __u64 target;
+    __s64 error_ns;
+};
+
+/* hist[0]: < 1us, hist[i]: [2^(i-1), 2^i) us, the last bucket takes the rest */
+#define RK_TIMER_LAT_BUCKETS     (24)
+
+struct rk_timer_lat_stat {
+    __u64 count;
+    __u64 min_ns;
+    __u64 max_ns;
+    __u64 avg_ns;
+    __u64 sum_ns;
+    __u32 hist[RK_TIMER_LAT_BUCKETS];
+};
+
+struct rk_timer_latency {
+    struct rk_timer_lat_stat irq;   /* expiry -> rk_timer_interrupt() entry */
+    struct rk_timer_lat_stat wake;  /* expiry -> consumer back in poll() */
+};
 
 struct rk_timer_reg {
     unsigned int load_cnt0;
@@ -45,6 +129,24 @@ struct rk_timer {
     struct rk_timer_reg *reg;
     struct clk *timer_clk;
     struct clk *pclk;
+    bool emulated;              /* register block provided by rk_sim */
+    struct device *dev;
+    /* running, runtime PM reference held while running */
+    struct mutex pm_lock;
+    bool running;
+    unsigned int saved_ctlreg;
+    /* RK_TIMER_START -> counter enabled, and -> first tick (beyond interval) */
+    ktime_t start_time;
+    bool first_tick;
+    u64 start_latency_ns;
+    u64 start_latency_max_ns;
+    u64 first_tick_latency_ns;
+    u64 first_tick_latency_max_ns;
+    unsigned long resume_latency_exceeded;
+    /* per-tick latency, measured from the down-counter; timer->lock */
+    ktime_t expiry_time;
+    struct rk_timer_latency latency;
+    struct dentry *debugfs;
 };
 
 static void __iomem *timer_base;
@@ -53,13 +155,65 @@ static struct rk_timer *g_ptimer;
 
 DECLARE_WAIT_QUEUE_HEAD(rk_timer_wq);
 
+static void lat_stat_add(struct rk_timer_lat_stat *stat, u64 ns)
+{
+    unsigned int bucket = 0;
+
+    if (ns >= NSEC_PER_USEC)
+        bucket = min_t(unsigned int, ilog2(div_u64(ns, NSEC_PER_USEC)) + 1,
+                       RK_TIMER_LAT_BUCKETS - 1);
+
+    if (!stat->count || ns < stat->min_ns)
+        stat->min_ns = ns;
+    if (ns > stat->max_ns)
+        stat->max_ns = ns;
+    stat->count++;
+    stat->sum_ns += ns;
+    stat->hist[bucket]++;
+}
+
 static irqreturn_t rk_timer_interrupt(int irq, void *dev_id)
 {
     unsigned long flags;
+    u64 load, curr, lat_ns;
+    ktime_t now;
+
+    /*
+     * The counter reloaded from load_cnt at expiry and has been counting
+     * down since, so (load - curr) is exactly how late we got here.
+     * Sample it before anything else.
+     */
+    curr = readl(&g_ptimer->reg->curr_val0);
+    curr |= (u64)readl(&g_ptimer->reg->curr_val1) << 32;
+    now = ktime_get();
+    load = readl(&g_ptimer->reg->load_cnt0);
+    load |= (u64)readl(&g_ptimer->reg->load_cnt1) << 32;
 
     spin_lock_irqsave(&g_ptimer->lock, flags);
     /* clear INTSTATUS */
     writel(1, &g_ptimer->reg->stat);
+    if (curr <= load) {
+        lat_ns = div_u64((load - curr) * 1000, 24);     /* clock: 24MHz */
+        lat_stat_add(&g_ptimer->latency.irq, lat_ns);
+        g_ptimer->expiry_time = ktime_sub_ns(now, lat_ns);
+    } else {
+        g_ptimer->expiry_time = now;
+    }
+    if (g_ptimer->first_tick) {
+        s64 ns = ktime_to_ns(ktime_sub(ktime_get(), g_ptimer->start_time)) -
+                 (s64)g_ptimer->interval * NSEC_PER_USEC;
+
+        g_ptimer->first_tick = false;
+        g_ptimer->first_tick_latency_ns = max_t(s64, ns, 0);
+        g_ptimer->first_tick_latency_max_ns = max(g_ptimer->first_tick_latency_max_ns,
+                                                  g_ptimer->first_tick_latency_ns);
+        if (g_ptimer->first_tick_latency_ns >
+            (u64)resume_latency_limit_us * NSEC_PER_USEC) {
+            g_ptimer->resume_latency_exceeded++;
+            dev_warn_ratelimited(g_ptimer->dev, "first tick %llu ns late\n",
+                                 g_ptimer->first_tick_latency_ns);
+        }
+    }
     g_ptimer->done = true;
     wake_up(&rk_timer_wq);
 
@@ -73,7 +227,7 @@ static void timer_set_interval(struct rk_timer *timer, u64 us)
     struct rk_timer_reg *timer_reg = timer->reg;
     u64 count;
 
-    if (us >= 1000 && us <= 10000000) {      /* allow: 1ms ~ 10s */
+    if (us >= RK_TIMER_INTERVAL_MIN_US && us <= RK_TIMER_INTERVAL_MAX_US) {
         /* clock: 24MHz */
         /* period : 1.0 / 24000000 * 1000000 = 1 / 24 us */
         count = 24 * us;
@@ -131,6 +285,188 @@ static void timer_init(struct rk_timer *timer)
     timer->interval = 10000;
 }
 
+/*
+ * The clocks are only enabled while the counter runs, or briefly around a
+ * register access; rk_timer_runtime_resume() restores interval and mode.
+ */
+static int rk_timer_start(struct rk_timer *timer)
+{
+    ktime_t t0 = ktime_get();
+    unsigned long flags;
+    int err;
+
+    mutex_lock(&timer->pm_lock);
+    if (timer->running)
+        goto out;
+
+    err = pm_runtime_get_sync(timer->dev);
+    if (err < 0) {
+        pm_runtime_put_noidle(timer->dev);
+        mutex_unlock(&timer->pm_lock);
+        return err;
+    }
+    timer->running = true;
+
+    spin_lock_irqsave(&timer->lock, flags);
+    timer_enable(timer);
+    timer->start_time = t0;
+    timer->first_tick = true;
+    timer->start_latency_ns = ktime_to_ns(ktime_sub(ktime_get(), t0));
+    timer->start_latency_max_ns = max(timer->start_latency_max_ns,
+                                      timer->start_latency_ns);
+    if (timer->start_latency_ns > (u64)resume_latency_limit_us * NSEC_PER_USEC) {
+        timer->resume_latency_exceeded++;
+        dev_warn_ratelimited(timer->dev, "start took %llu ns\n",
+                             timer->start_latency_ns);
+    }
+    spin_unlock_irqrestore(&timer->lock, flags);
+out:
+    mutex_unlock(&timer->pm_lock);
+    return 0;
+}
+
+static void rk_timer_stop(struct rk_timer *timer)
+{
+    mutex_lock(&timer->pm_lock);
+    if (timer->running) {
+        timer_disable(timer);
+        timer->running = false;
+        pm_runtime_mark_last_busy(timer->dev);
+        pm_runtime_put_autosuspend(timer->dev);
+    }
+    mutex_unlock(&timer->pm_lock);
+}
+
+static void rk_timer_get_latency(struct rk_timer *timer,
+        struct rk_timer_latency *latency)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&timer->lock, flags);
+    *latency = timer->latency;
+    spin_unlock_irqrestore(&timer->lock, flags);
+
+    if (latency->irq.count)
+        latency->irq.avg_ns = div64_u64(latency->irq.sum_ns, latency->irq.count);
+    if (latency->wake.count)
+        latency->wake.avg_ns = div64_u64(latency->wake.sum_ns, latency->wake.count);
+}
+
+static void rk_timer_reset_latency(struct rk_timer *timer)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&timer->lock, flags);
+    memset(&timer->latency, 0, sizeof(timer->latency));
+    spin_unlock_irqrestore(&timer->lock, flags);
+}
+
+static u64 timer_read_counter(struct rk_timer *timer)
+{
+    u64 curr = readl(&timer->reg->curr_val0);
+
+    return curr | (u64)readl(&timer->reg->curr_val1) << 32;
+}
+
+static u64 timer_read_load(struct rk_timer *timer)
+{
+    u64 load = readl(&timer->reg->load_cnt0);
+
+    return load | (u64)readl(&timer->reg->load_cnt1) << 32;
+}
+
+/* counter ticks (24MHz) from curr down to target, across a reload if needed */
+static u64 timer_ticks_to(u64 curr, u64 target, u64 load)
+{
+    return curr >= target ? curr - target : curr + load - target;
+}
+
+static int rk_timer_wait(struct rk_timer *timer, struct rk_timer_wait *wait)
+{
+    u64 spin_ns = min_t(u64, wait->spin_ns, (u64)max_spin_us * NSEC_PER_USEC);
+    u64 load = 0, curr, prev;
+    ktime_t deadline, wake, limit;
+    int err = 0;
+
+    switch (wait->mode) {
+    case RK_TIMER_WAIT_DEADLINE:
+        deadline = ns_to_ktime(wait->target);
+        break;
+    case RK_TIMER_WAIT_COUNTER:
+        /* keep the clocks on while the counter is read, even across a STOP */
+        err = pm_runtime_get_sync(timer->dev);
+        if (err < 0)
+            goto out_put;
+        err = 0;
+        mutex_lock(&timer->pm_lock);
+        if (!timer->running) {
+            mutex_unlock(&timer->pm_lock);
+            err = -EINVAL;
+            goto out_put;
+        }
+        mutex_unlock(&timer->pm_lock);
+        load = timer_read_load(timer);
+        if (wait->target >= load) {
+            err = -EINVAL;
+            goto out_put;
+        }
+        curr = timer_read_counter(timer);
+        deadline = ktime_add_ns(ktime_get(),
+                div_u64(timer_ticks_to(curr, wait->target, load) * 1000, 24));
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    /* coarse part: sleep on an hrtimer until the spin window opens */
+    wake = ktime_sub_ns(deadline, spin_ns);
+    while (ktime_after(wake, ktime_get())) {
+        set_current_state(TASK_INTERRUPTIBLE);
+        schedule_hrtimeout_range(&wake, 0, HRTIMER_MODE_ABS);
+        if (signal_pending(current)) {
+            err = -ERESTARTSYS;
+            goto out_put;
+        }
+    }
+
+    if (wait->mode == RK_TIMER_WAIT_COUNTER && !READ_ONCE(timer->running)) {
+        err = -EINVAL;
+        goto out_put;
+    }
+
+    /* fine part: busy-poll, never longer than spin_ns */
+    preempt_disable();
+    limit = ktime_add_ns(ktime_get(), spin_ns);
+    if (wait->mode == RK_TIMER_WAIT_COUNTER) {
+        prev = timer_read_counter(timer);
+        for (;;) {
+            curr = timer_read_counter(timer);
+            /* reached the target, or reloaded past it */
+            if (curr <= wait->target || curr > prev || ktime_after(ktime_get(), limit))
+                break;
+            prev = curr;
+            cpu_relax();
+        }
+        preempt_enable();
+        /* how far the counter has run past the target */
+        wait->error_ns = div_u64(timer_ticks_to(wait->target, curr, load) * 1000, 24);
+        if (wait->error_ns > div_u64(load * 1000, 48))     /* more than half a period: early */
+            wait->error_ns -= div_u64(load * 1000, 24);
+    } else {
+        while (ktime_before(ktime_get(), deadline) && ktime_before(ktime_get(), limit))
+            cpu_relax();
+        wait->error_ns = ktime_to_ns(ktime_sub(ktime_get(), deadline));
+        preempt_enable();
+    }
+
+out_put:
+    if (wait->mode == RK_TIMER_WAIT_COUNTER) {
+        pm_runtime_mark_last_busy(timer->dev);
+        pm_runtime_put_autosuspend(timer->dev);
+    }
+    return err;
+}
+
 static int rk_timer_open(struct inode *inode, struct file *file)
 {
     struct rk_timer *timer;
@@ -149,8 +485,8 @@ static int rk_timer_release(struct inode *inode, struct file *file)
 
     timer = container_of(file->private_data, struct rk_timer, miscdev);
 
+    rk_timer_stop(timer);
     clear_bit(0, &timer->dev_opened);
-    timer_disable(timer);
 
     return 0;
 }
@@ -169,6 +505,8 @@ static unsigned int rk_timer_poll(struct file *file, poll_table *wait)
     if (timer->done) {
         ret = POLLIN | POLLRDNORM;
         timer->done = false;
+        lat_stat_add(&timer->latency.wake,
+                     ktime_to_ns(ktime_sub(ktime_get(), timer->expiry_time)));
     } else {
         ret = 0;
     }
@@ -185,20 +523,56 @@ static long rk_timer_ioctl(struct file *file, unsigned int cmd, unsigned long ar
 
     switch (cmd) {
         case RK_TIMER_START:
-            timer_enable(timer);
-            break;
+            return rk_timer_start(timer);
         case RK_TIMER_STOP:
-            timer_disable(timer);
+            rk_timer_stop(timer);
             break;
         case RK_TIMER_SET_INTERVAL:
         {
             unsigned int val;
+            int err;
 
             if (copy_from_user(&val, (void __user *)arg, sizeof(int)))
                 return -EFAULT;
-
+            /* never store what timer_set_interval() would ignore */
+            if (val < RK_TIMER_INTERVAL_MIN_US || val > RK_TIMER_INTERVAL_MAX_US)
+                return -EINVAL;
+
+            err = pm_runtime_get_sync(timer->dev);
+            if (err < 0) {
+                pm_runtime_put_noidle(timer->dev);
+                return err;
+            }
             timer->interval = val;
             timer_set_interval(timer, timer->interval);
+            pm_runtime_mark_last_busy(timer->dev);
+            pm_runtime_put_autosuspend(timer->dev);
+            break;
+        }
+        case RK_TIMER_GET_LATENCY:
+        {
+            struct rk_timer_latency latency;
+
+            rk_timer_get_latency(timer, &latency);
+            if (copy_to_user((void __user *)arg, &latency, sizeof(latency)))
+                return -EFAULT;
+            break;
+        }
+        case RK_TIMER_RESET_LATENCY:
+            rk_timer_reset_latency(timer);
+            break;
+        case RK_TIMER_WAIT:
+        {
+            struct rk_timer_wait wait;
+            int err;
+
+            if (copy_from_user(&wait, (void __user *)arg, sizeof(wait)))
+                return -EFAULT;
+            err = rk_timer_wait(timer, &wait);
+            if (err)
+                return err;
+            if (copy_to_user((void __user *)arg, &wait, sizeof(wait)))
+                return -EFAULT;
             break;
         }
         default:
@@ -208,6 +582,55 @@ static long rk_timer_ioctl(struct file *file, unsigned int cmd, unsigned long ar
     return 0;
 }
 
+static int rk_timer_latency_show(struct seq_file *s, void *unused)
+{
+    struct rk_timer *timer = s->private;
+    struct rk_timer_latency latency;
+    struct rk_timer_lat_stat *stat[] = { &latency.irq, &latency.wake };
+    const char *name[] = { "irq", "wake" };
+    int i, j;
+
+    rk_timer_get_latency(timer, &latency);
+    for (i = 0; i < ARRAY_SIZE(stat); i++) {
+        seq_printf(s, "%s: count %llu min %llu avg %llu max %llu ns\n", name[i],
+                   stat[i]->count, stat[i]->min_ns, stat[i]->avg_ns, stat[i]->max_ns);
+        for (j = 0; j < RK_TIMER_LAT_BUCKETS; j++) {
+            if (!stat[i]->hist[j])
+                continue;
+            if (j == 0)
+                seq_printf(s, "  %8s < %6u us: %u\n", "", 1, stat[i]->hist[j]);
+            else
+                seq_printf(s, "  %8u ~ %6u us: %u\n", 1U << (j - 1), 1U << j,
+                           stat[i]->hist[j]);
+        }
+    }
+    return 0;
+}
+
+static int rk_timer_latency_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, rk_timer_latency_show, inode->i_private);
+}
+
+/* any write resets the statistics */
+static ssize_t rk_timer_latency_write(struct file *file, const char __user *ubuf,
+        size_t count, loff_t *offset)
+{
+    struct seq_file *s = file->private_data;
+
+    rk_timer_reset_latency(s->private);
+    return count;
+}
+
+static const struct file_operations rk_timer_latency_fops = {
+    .owner   = THIS_MODULE,
+    .open    = rk_timer_latency_open,
+    .read    = seq_read,
+    .write   = rk_timer_latency_write,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
 static const struct file_operations rk_timer_fops = {
     .owner   = THIS_MODULE,
     .llseek  = no_llseek,
@@ -218,23 +641,187 @@ static const struct file_operations rk_timer_fops = {
     .compat_ioctl   = rk_timer_ioctl,
 };
 
+static ssize_t start_latency_last_ns_show(struct device *dev,
+        struct device_attribute *attr, char *buf)
+{
+    struct rk_timer *timer = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%llu\n", timer->start_latency_ns);
+}
+static DEVICE_ATTR_RO(start_latency_last_ns);
+
+static ssize_t start_latency_max_ns_show(struct device *dev,
+        struct device_attribute *attr, char *buf)
+{
+    struct rk_timer *timer = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%llu\n", timer->start_latency_max_ns);
+}
+static DEVICE_ATTR_RO(start_latency_max_ns);
+
+static ssize_t first_tick_latency_last_ns_show(struct device *dev,
+        struct device_attribute *attr, char *buf)
+{
+    struct rk_timer *timer = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%llu\n", timer->first_tick_latency_ns);
+}
+static DEVICE_ATTR_RO(first_tick_latency_last_ns);
+
+static ssize_t first_tick_latency_max_ns_show(struct device *dev,
+        struct device_attribute *attr, char *buf)
+{
+    struct rk_timer *timer = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%llu\n", timer->first_tick_latency_max_ns);
+}
+static DEVICE_ATTR_RO(first_tick_latency_max_ns);
+
+static ssize_t resume_latency_exceeded_show(struct device *dev,
+        struct device_attribute *attr, char *buf)
+{
+    struct rk_timer *timer = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%lu\n", timer->resume_latency_exceeded);
+}
+static DEVICE_ATTR_RO(resume_latency_exceeded);
+
+static struct attribute *rk_timer_attrs[] = {
+    &dev_attr_start_latency_last_ns.attr,
+    &dev_attr_start_latency_max_ns.attr,
+    &dev_attr_first_tick_latency_last_ns.attr,
+    &dev_attr_first_tick_latency_max_ns.attr,
+    &dev_attr_resume_latency_exceeded.attr,
+    NULL,
+};
+
+static const struct attribute_group rk_timer_attr_group = {
+    .attrs = rk_timer_attrs,
+};
+
 static int rk_timer_remove(struct platform_device *pdev)
 {
     struct rk_timer *timer = platform_get_drvdata(pdev);
 
+    debugfs_remove_recursive(timer->debugfs);
+    sysfs_remove_group(&pdev->dev.kobj, &rk_timer_attr_group);
+    /* leave the clocks enabled for the clk_disable_unprepare() below */
+    pm_runtime_get_sync(&pdev->dev);
+    pm_runtime_disable(&pdev->dev);
+    pm_runtime_put_noidle(&pdev->dev);
+    pm_runtime_dont_use_autosuspend(&pdev->dev);
+
     free_irq(timer->irq, NULL);
     misc_deregister(&timer->miscdev);
     clk_disable_unprepare(timer->timer_clk);
     clk_disable_unprepare(timer->pclk);
-    iounmap(timer->reg);
+    if (!timer->emulated)
+        iounmap(timer->reg);
     kfree(timer);
 
     return 0;
 }
 
-static int rk_timer_probe(struct platform_device *pdev)
+static int rk_timer_setup(struct platform_device *pdev,
+        struct rk_timer_reg *timer_reg, struct clk *pclk,
+        struct clk *timer_clk, int irq)
 {
     struct rk_timer *timer;
+    int err;
+
+    timer = kzalloc(sizeof(*timer), GFP_KERNEL);
+    if (!timer)
+        return -ENOMEM;
+
+    spin_lock_init(&timer->lock);
+    mutex_init(&timer->pm_lock);
+    timer->dev = &pdev->dev;
+    platform_set_drvdata(pdev, timer);
+
+    /* attributes exist before the device node does */
+    err = sysfs_create_group(&pdev->dev.kobj, &rk_timer_attr_group);
+    if (err) {
+        pr_err("Failed to create rk_timer2 sysfs attributes\n");
+        goto err_free_priv;
+    }
+
+    timer->miscdev.minor = MISC_DYNAMIC_MINOR;
+    timer->miscdev.name = "rk_timer2";
+    timer->miscdev.fops = &rk_timer_fops;
+    err = misc_register(&timer->miscdev);
+    if (err) {
+        pr_err("Register %s failed\n", timer->miscdev.name);
+        goto err_remove_group;
+    }
+    pr_err("misc_register success\n");
+
+    timer->reg = timer_reg;
+    timer->pclk = pclk;
+    timer->timer_clk = timer_clk;
+    timer->emulated = !pdev->dev.of_node;
+
+    timer_init(timer);
+
+    g_ptimer = timer;
+
+    timer->irq = irq;
+    err = request_irq(irq, rk_timer_interrupt, IRQF_TIMER, "rk_timer2", NULL);
+
+    if (err < 0) {
+        pr_err("fail to request rk_timer2 irq\n");
+        goto err_misc_register;
+    }
+
+    timer->debugfs = debugfs_create_dir("rk_timer2", NULL);
+    if (!IS_ERR_OR_NULL(timer->debugfs))
+        debugfs_create_file("latency", 0644, timer->debugfs, timer,
+                            &rk_timer_latency_fops);
+
+    /* clocks are on from probe: start active, gate after autosuspend_ms */
+    pm_runtime_set_active(&pdev->dev);
+    pm_runtime_use_autosuspend(&pdev->dev);
+    pm_runtime_set_autosuspend_delay(&pdev->dev, autosuspend_ms);
+    pm_runtime_enable(&pdev->dev);
+    pm_runtime_mark_last_busy(&pdev->dev);
+    pm_runtime_idle(&pdev->dev);
+
+    return 0;
+
+err_misc_register:
+    misc_deregister(&timer->miscdev);
+err_remove_group:
+    sysfs_remove_group(&pdev->dev.kobj, &rk_timer_attr_group);
+err_free_priv:
+    kfree(timer);
+    return err;
+}
+
+/*
+ * No DT node: the register block is ordinary memory handed over as platform
+ * data and the IRQ is a software one, both owned by the rk_sim harness.
+ * There are no clocks to enable.
+ */
+static int rk_timer_probe_emulated(struct platform_device *pdev)
+{
+    struct rk_timer_reg *timer_reg = dev_get_platdata(&pdev->dev);
+    int irq;
+
+    if (!timer_reg) {
+        pr_err("No register block for emulated rk_timer2\n");
+        return -EINVAL;
+    }
+
+    irq = platform_get_irq(pdev, 0);
+    if (irq < 0) {
+        pr_err("No irq for emulated rk_timer2\n");
+        return irq;
+    }
+
+    return rk_timer_setup(pdev, timer_reg, NULL, NULL, irq);
+}
+
+static int rk_timer_probe(struct platform_device *pdev)
+{
     int err, irq;
     struct clk *timer_clk;
     struct clk *pclk;
@@ -242,6 +829,9 @@ static int rk_timer_probe(struct platform_device *pdev)
 
     struct device_node *np = pdev->dev.of_node;
 
+    if (!np)
+        return rk_timer_probe_emulated(pdev);
+
     timer_base = of_iomap(np, 0);
     if (!timer_base) {
         pr_err("Failed to get base address for rk_timer2\n");
@@ -277,77 +867,50 @@ static int rk_timer_probe(struct platform_device *pdev)
         return -EINVAL;
     }
 
-    timer = kzalloc(sizeof(*timer), GFP_KERNEL);
-    if (!timer) {
-        err = -ENOMEM;
-        goto err_return;
-    }
-
-    spin_lock_init(&timer->lock);
-
-    timer->miscdev.minor = MISC_DYNAMIC_MINOR;
-    timer->miscdev.name = "rk_timer2";
-    timer->miscdev.fops = &rk_timer_fops;
-    err = misc_register(&timer->miscdev);
+    err = rk_timer_setup(pdev, timer_reg, pclk, timer_clk, irq);
     if (err) {
-        pr_err("Register %s failed\n", timer->miscdev.name);
-        goto err_free_priv;
+        clk_disable_unprepare(timer_clk);
+        clk_disable_unprepare(pclk);
+        iounmap(timer_reg);
     }
-    pr_err("misc_register success\n");
-
-    timer->reg = timer_reg;
-    timer->pclk = pclk;
-    timer->timer_clk = timer_clk;
-
-    timer_init(timer);
-
-    g_ptimer = timer;
-
-    timer->irq = irq;
-    err = request_irq(irq, rk_timer_interrupt, IRQF_TIMER, "rk_timer2", NULL);
-
-    if (err < 0) {
-        pr_err("fail to request rk_timer2 irq\n");
-        goto err_misc_register;
-    }
-
-    platform_set_drvdata(pdev, timer);
-
-    return 0;
-
-err_misc_register:
-    misc_deregister(&timer->miscdev);
-err_free_priv:
-    kfree(timer);
-err_return:
-    clk_disable_unprepare(timer->timer_clk);
-    clk_disable_unprepare(timer->pclk);
-    iounmap(timer->reg);
     return err;
 }
 
 #if defined CONFIG_PM
-int rk_timer_suspend(struct device *dev)
+static int rk_timer_runtime_suspend(struct device *dev)
 {
     struct rk_timer *timer = dev_get_drvdata(dev);
 
+    timer->saved_ctlreg = readl(&timer->reg->ctlreg);
     timer_disable(timer);
+    clk_disable(timer->timer_clk);
+    clk_disable(timer->pclk);
     return 0;
 }
 
-int rk_timer_resume(struct device *dev)
+static int rk_timer_runtime_resume(struct device *dev)
 {
     struct rk_timer *timer = dev_get_drvdata(dev);
+    int err;
+
+    /* clocks stay prepared, so this is safe and quick from any path */
+    err = clk_enable(timer->pclk);
+    if (err)
+        return err;
+    err = clk_enable(timer->timer_clk);
+    if (err) {
+        clk_disable(timer->pclk);
+        return err;
+    }
 
     timer_set_interval(timer, timer->interval);
-    if (timer->dev_opened)
-        timer_enable(timer);
+    writel(timer->saved_ctlreg, &timer->reg->ctlreg);
     return 0;
 }
 
 static const struct dev_pm_ops rk_timer_pm_ops = {
-    .suspend = rk_timer_suspend,
-    .resume  = rk_timer_resume,
+    SET_SYSTEM_SLEEP_PM_OPS(pm_runtime_force_suspend, pm_runtime_force_resume)
+    SET_RUNTIME_PM_OPS(rk_timer_runtime_suspend, rk_timer_runtime_resume, NULL)
 };
 #endif
 
@@ -366,6 +929,7 @@ static struct platform_driver rk_timer_driver = {
         .pm = &rk_timer_pm_ops,
 #endif
         .of_match_table = rk_timer_of_ids,
+        .probe_type = PROBE_PREFER_ASYNCHRONOUS,
     },
 };
 